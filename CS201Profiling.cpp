@@ -10,9 +10,16 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Type.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
 #include <map>
 #include <set>
 #include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
 #include <iterator>
 #include <algorithm>
 using namespace llvm;
@@ -26,6 +33,46 @@ cl::opt<bool> dumpBasicBlock(
   "dumpbb",
   cl::desc("Dump basic block textural IR."));
 
+cl::opt<std::string> profileFilename(
+  "profile",
+  cl::desc("Profile written by a previous instrumented run."),
+  cl::value_desc("filename"));
+
+cl::opt<bool> layoutReport(
+  "layout",
+  cl::desc("Report a profile guided basic block and function order."));
+
+cl::opt<bool> reorderBasicBlock(
+  "reorderbb",
+  cl::desc("Reorder basic blocks and functions by the profile "
+    "instead of instrumenting."));
+
+cl::opt<std::string> cacheDirectory(
+  "cachedir",
+  cl::desc("Directory to cache the analysis of unchanged functions."),
+  cl::value_desc("directory"));
+
+enum CounterLayout {
+  FlatLayout,
+  FunctionLayout
+};
+
+cl::opt<CounterLayout> counterLayout(
+  "counterlayout",
+  cl::desc("Memory layout of the counters."),
+  cl::init(FlatLayout),
+  cl::values(
+    clEnumValN(FlatLayout, "flat",
+      "Module wide block counters and edge matrix"),
+    clEnumValN(FunctionLayout, "function",
+      "Block and edge counters of each function stored together"),
+    clEnumValEnd));
+
+cl::opt<bool> maskEdgesAtEntry(
+  "maskentry",
+  cl::desc("Mask the edges of a function once at its entry "
+    "instead of in every block(flat layout only)."));
+
 namespace {
   struct CS201Profiling : public FunctionPass {
     static char ID;
@@ -38,9 +85,22 @@ namespace {
       // Initialize frequently used constants.
       zero32 = ConstantInt::get(*context, APInt(32, StringRef("0"), 10));
 
+      if (!profileFilename.empty())
+        loadProfile(profileFilename);
+
+      if (!cacheDirectory.empty())
+        sys::fs::create_directories(cacheDirectory);
+
+      // The second invocation only reorders the IR.
+      if (reorderBasicBlock)
+        return false;
+
       // Preprocess all modules to compute the number of counters.
       preprocessModule(M);
 
+      if (counterLayout == FunctionLayout)
+        computeCounterLayout(M);
+
       // Allocate global variables(e.g. counters, names).
       allocateGlobalVariables(M);
 
@@ -51,13 +111,33 @@ namespace {
       std::vector<Type*> outputArgTypes;
       outputArgTypes.push_back(Type::getInt8PtrTy(*context)->getPointerTo());
       outputArgTypes.push_back(Type::getInt8PtrTy(*context)->getPointerTo());
+      if (counterLayout == FunctionLayout) {
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32Ty(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32Ty(*context));
+      }
+      else {
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+        outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+      }
+      outputArgTypes.push_back(Type::getInt32PtrTy(*context));
       outputArgTypes.push_back(Type::getInt32PtrTy(*context));
+      outputArgTypes.push_back(Type::getInt32Ty(*context));
+      outputArgTypes.push_back(Type::getInt32Ty(*context));
       outputArgTypes.push_back(Type::getInt32PtrTy(*context));
       outputArgTypes.push_back(Type::getInt32PtrTy(*context));
       outputArgTypes.push_back(Type::getInt32PtrTy(*context));
       outputArgTypes.push_back(Type::getInt32PtrTy(*context));
       outputArgTypes.push_back(Type::getInt32Ty(*context));
       outputArgTypes.push_back(Type::getInt32Ty(*context));
+      outputArgTypes.push_back(Type::getInt32Ty(*context));
       
       FunctionType* outputType = FunctionType::get(
         Type::getVoidTy(*context),
@@ -66,7 +146,8 @@ namespace {
       outputFunction = Function::Create(
         outputType,
         Function::ExternalLinkage,
-        Twine("outputProfilingResult"),
+        Twine(counterLayout == FunctionLayout ?
+          "outputGroupedProfilingResult" : "outputProfilingResult"),
         &M);
       outputFunction->setCallingConv(CallingConv::C);
       
@@ -75,8 +156,28 @@ namespace {
 
     //----------------------------------
     bool doFinalization(Module &M) override {
+      bool modified = false;
+      if (layoutReport || reorderBasicBlock) {
+        std::vector<Function*> order = computeFunctionLayout(M);
+
+        outs() << SEPARATOR << "FUNCTION LAYOUT:\n";
+        for (auto f : order) {
+          outs() << f->getName() << "\n";
+        }
+
+        if (reorderBasicBlock) {
+          // Moving every function to the end in order
+          // leaves the declarations in front.
+          for (auto f : order) {
+            M.getFunctionList().remove(f);
+            M.getFunctionList().push_back(f);
+          }
+          modified = true;
+        }
+      }
+
       outs() << "\nEND OF ANALYSIS\n\n";
-      return false;
+      return modified;
     }
     
     //----------------------------------
@@ -86,7 +187,33 @@ namespace {
       outs() << "FUNCTION: " << functionName << "\n";
 
       preprocessFunction(F);
-      computeLoops(F);
+
+      if (reorderBasicBlock) {
+        std::vector<BasicBlock*> order = computeBlockLayout(F);
+        outputBlockLayout(order);
+        for (int i = 1; i < (int)order.size(); ++i) {
+          order[i]->moveAfter(order[i - 1]);
+        }
+        return true;
+      }
+
+      // Dominators only depend on the CFG,
+      // so they are reused as long as the function is unchanged.
+      DomSet dom;
+      std::string cacheFilename = getCacheFilename(F);
+      if (cacheFilename.empty() || !loadAnalysis(cacheFilename, F, dom)) {
+        dom = computeDOMSet(F);
+        if (!cacheFilename.empty())
+          saveAnalysis(cacheFilename, F, dom);
+      }
+      computeLoops(F, dom);
+      computeCycles(F);
+      outputDOMSet(dom);
+      outputLoops();
+      outputCycles();
+
+      if (layoutReport)
+        outputBlockLayout(computeBlockLayout(F));
 
       // Display basic blocks and their predecessors.
       outs() << SEPARATOR2 << "BASIC BLOCKS: " << F.size() << "\n";
@@ -109,6 +236,7 @@ namespace {
       }
 
       currentLoopID = loops.size();
+      currentCycleID = cycles.size();
 
       return true;
     }
@@ -132,6 +260,46 @@ namespace {
     GlobalVariable* backEdgeHeads;
     GlobalVariable* backEdgeTails;
 
+    // Counters for `-counterlayout=function`.
+    // counterRegions has a hot and a cold region,
+    // where every block counter is followed by its out edge counters
+    // of the same region:
+    //   [bb0][bb0->x][bb0->y][bb1][bb1->z]...
+    // The hot region holds the counters executed in the profile
+    // of all functions, from the hottest function and block,
+    // so that the hot counters are packed together.
+    // Without a profile everything is in the cold region.
+    // Calls are not counted, a call edge executes as often as its block.
+    std::vector<int> bbSlots;
+    // <tailID, headID> -> slot
+    std::map<pair<int, int>, int> edgeSlots;
+    std::vector<int> callTails, callHeads;
+    // headID -> rank of the targets of indirectbr in their function.
+    // The edges of an indirectbr take one slot per rank
+    // and are counted by the target(see countEdges).
+    std::map<int, int> indirectRanks;
+    // Taken by the targets of indirectbr reached by other edges.
+    int sinkSlot;
+    // Slot of the edge being taken to a landing pad or an indirectbr target.
+    Value* landingPadPending;
+    Value* indirectPending;
+
+    GlobalVariable* counterRegions;
+    GlobalVariable* bbSlotArray;
+    GlobalVariable* edgeTailArray;
+    GlobalVariable* edgeHeadArray;
+    GlobalVariable* edgeSlotArray;
+    GlobalVariable* callTailArray;
+    GlobalVariable* callHeadArray;
+
+    GlobalVariable* cycleEntryArray;
+    GlobalVariable* cycleEntryCycles;
+    GlobalVariable* cycleInsideTails;
+    GlobalVariable* cycleInsideHeads;
+
+    int numCounters;
+    int numEdges;
+
     Function* outputFunction;
     
     // <functionName, bbName> -> bbID
@@ -140,10 +308,250 @@ namespace {
     std::vector<std::set<int>> loops;
     std::vector<int> tails, heads;
     int currentLoopID;
+    // Irreducible cycles, i.e. cycles with more than one entry.
+    std::vector<std::vector<int>> cycles, cycleEntries;
+    // <tail, entry> of the edges going back to an entry of each cycle
+    std::vector<std::vector<pair<int, int>>> cycleInsideEdges;
+    int currentCycleID;
 
     StringRef functionName;
     std::map<StringRef, std::vector<StringRef>> preds;
 
+    // Profile loaded by `-profile`.
+    struct ProfileEdge {
+      std::string tail, head;
+      int count;
+    };
+    // <functionName, bbName> -> count
+    std::map<pair<std::string, std::string>, int> profileBBCounters;
+    // functionName -> edges within the function
+    std::map<std::string, std::vector<ProfileEdge>> profileEdges;
+    // <caller, callee> -> count
+    std::map<pair<std::string, std::string>, int> profileCalls;
+
+    void loadProfile(const std::string& filename) {
+      std::ifstream in(filename.c_str());
+      if (!in) {
+        errs() << "Cannot read profile " << filename << "\n";
+        return;
+      }
+
+      std::string kind;
+      while (in >> kind) {
+        if (kind == "BB") {
+          std::string f, bb;
+          int count;
+          in >> f >> bb >> count;
+          profileBBCounters[make_pair(f, bb)] += count;
+        }
+        else if (kind == "EDGE") {
+          std::string tailFunction, tail, headFunction, head;
+          int count;
+          in >> tailFunction >> tail >> headFunction >> head >> count;
+          if (tailFunction == headFunction) {
+            ProfileEdge e = { tail, head, count };
+            profileEdges[tailFunction].push_back(e);
+          }
+          else {
+            // Only calls cross functions.
+            // Returns are not recorded:
+            // the flat layout restores lastBB after each call
+            // and the function layout derives the calls from the blocks.
+            profileCalls[make_pair(tailFunction, headFunction)] += count;
+          }
+        }
+        else {
+          errs() << "Malformed profile " << filename << "\n";
+          return;
+        }
+      }
+    }
+
+    int profileCount(StringRef f, StringRef bb) {
+      auto it = profileBBCounters.find(make_pair(f.str(), bb.str()));
+      return it == profileBBCounters.end() ? 0 : it->second;
+    }
+
+    // Pettis-Hansen style bottom-up chain merging.
+    // Edges are visited from the hottest one.
+    // Two chains are merged if the edge connects the end of one chain
+    // to the start of the other, so that the edge becomes a fall-through.
+    // The chains are then placed by their hotness,
+    // leaving the cold(never executed) blocks at the end.
+    std::vector<BasicBlock*> computeBlockLayout(Function& F) {
+      std::vector<BasicBlock*> blocks;
+      std::map<StringRef, int> index;
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        index[bb->getName()] = blocks.size();
+        blocks.push_back(bb);
+      }
+
+      int n = blocks.size();
+      std::vector<std::vector<int>> chains(n);
+      std::vector<int> chainOf(n);
+      for (int i = 0; i < n; ++i) {
+        chains[i].push_back(i);
+        chainOf[i] = i;
+      }
+
+      std::vector<ProfileEdge> edges = profileEdges[F.getName().str()];
+      std::stable_sort(edges.begin(), edges.end(),
+        [](const ProfileEdge& a, const ProfileEdge& b) {
+          return a.count > b.count;
+        });
+
+      for (auto& e : edges) {
+        auto t = index.find(e.tail);
+        auto h = index.find(e.head);
+        if (e.count <= 0 || t == index.end() || h == index.end())
+          continue;
+
+        int u = t->second;
+        int v = h->second;
+        int cu = chainOf[u];
+        int cv = chainOf[v];
+        // The entry block must stay at the front.
+        if (cu == cv || v == 0)
+          continue;
+        if (chains[cu].back() != u || chains[cv].front() != v)
+          continue;
+
+        for (auto x : chains[cv]) {
+          chains[cu].push_back(x);
+          chainOf[x] = cu;
+        }
+        chains[cv].clear();
+      }
+
+      // Weight of a chain is its hottest block.
+      std::vector<pair<int, int>> order;
+      for (int i = 0; i < n; ++i) {
+        if (chains[i].empty() || i == chainOf[0])
+          continue;
+        int weight = 0;
+        for (auto x : chains[i]) {
+          weight = std::max(weight,
+            profileCount(F.getName(), blocks[x]->getName()));
+        }
+        order.push_back(make_pair(weight, i));
+      }
+      std::stable_sort(order.begin(), order.end(),
+        [](const pair<int, int>& a, const pair<int, int>& b) {
+          return a.first > b.first;
+        });
+
+      std::vector<BasicBlock*> r;
+      for (auto x : chains[chainOf[0]]) {
+        r.push_back(blocks[x]);
+      }
+      for (auto c : order) {
+        for (auto x : chains[c.second]) {
+          r.push_back(blocks[x]);
+        }
+      }
+      return r;
+    }
+
+    void outputBlockLayout(const std::vector<BasicBlock*>& order) {
+      outs() << SEPARATOR2 << "BLOCK LAYOUT:\n";
+      for (auto bb : order) {
+        int count = profileCount(functionName, bb->getName());
+        outs() << bb->getName() << ": " << count;
+        if (count == 0)
+          outs() << " (cold)";
+        outs() << "\n";
+      }
+    }
+
+    // Pettis-Hansen function ordering.
+    // Functions are merged into clusters along the hottest calls first,
+    // the colder cluster going after the hotter one,
+    // then the clusters are placed by their hotness
+    // and the functions never executed go to the end.
+    std::vector<Function*> computeFunctionLayout(Module& M) {
+      std::vector<Function*> functions;
+      std::map<std::string, int> index;
+      std::vector<int> hotness;
+      for (auto f = M.begin(); f != M.end(); ++f) {
+        if (f->isDeclaration())
+          continue;
+        index[f->getName().str()] = functions.size();
+        functions.push_back(f);
+
+        int count = 0;
+        for (auto bb = f->begin(); bb != f->end(); ++bb) {
+          count += profileCount(f->getName(), bb->getName());
+        }
+        hotness.push_back(count);
+      }
+
+      // Calls are undirected here.
+      std::map<pair<int, int>, int> weights;
+      for (auto c : profileCalls) {
+        auto a = index.find(c.first.first);
+        auto b = index.find(c.first.second);
+        if (a == index.end() || b == index.end())
+          continue;
+        int u = std::min(a->second, b->second);
+        int v = std::max(a->second, b->second);
+        weights[make_pair(u, v)] += c.second;
+      }
+
+      std::vector<pair<int, pair<int, int>>> calls;
+      for (auto w : weights) {
+        calls.push_back(make_pair(w.second, w.first));
+      }
+      std::stable_sort(calls.begin(), calls.end(),
+        [](const pair<int, pair<int, int>>& a,
+          const pair<int, pair<int, int>>& b) {
+          return a.first > b.first;
+        });
+
+      int n = functions.size();
+      std::vector<std::vector<int>> clusters(n);
+      std::vector<int> clusterOf(n);
+      // Weight of a cluster is the sum of the hotness of its functions.
+      std::vector<int> weight(hotness);
+      for (int i = 0; i < n; ++i) {
+        clusters[i].push_back(i);
+        clusterOf[i] = i;
+      }
+
+      for (auto c : calls) {
+        int cu = clusterOf[c.second.first];
+        int cv = clusterOf[c.second.second];
+        if (c.first <= 0 || cu == cv)
+          continue;
+        if (weight[cv] > weight[cu])
+          std::swap(cu, cv);
+        for (auto x : clusters[cv]) {
+          clusters[cu].push_back(x);
+          clusterOf[x] = cu;
+        }
+        clusters[cv].clear();
+        weight[cu] += weight[cv];
+      }
+
+      std::vector<pair<int, int>> order;
+      for (int i = 0; i < n; ++i) {
+        if (clusters[i].empty())
+          continue;
+        order.push_back(make_pair(weight[i], i));
+      }
+      std::stable_sort(order.begin(), order.end(),
+        [](const pair<int, int>& a, const pair<int, int>& b) {
+          return a.first > b.first;
+        });
+
+      std::vector<Function*> r;
+      for (auto c : order) {
+        for (auto x : clusters[c.second]) {
+          r.push_back(functions[x]);
+        }
+      }
+      return r;
+    }
+
     GlobalVariable* createStaticString(Module& M, const char* text) {
       // Define format string for printf.
       Constant* value = ConstantDataArray::getString(*context, text);
@@ -160,15 +568,6 @@ namespace {
     void allocateGlobalVariables(Module& M) {
       int n = bbID.size();
 
-      // Variable to keep track of the last executed basic block.
-      lastBB = new GlobalVariable(
-        M,
-        Type::getInt32Ty(*context),
-        false,
-        GlobalValue::ExternalLinkage,
-        ConstantInt::get(Type::getInt32Ty(*context), 0),
-        "lastBB");
-
       // Define types.
       ArrayType* Int1D = ArrayType::get(IntegerType::get(*context, 32), n);
       ArrayType* Int2D = ArrayType::get(Int1D, n);
@@ -199,45 +598,274 @@ namespace {
         initCharPtr1D,
         "bbFunctionNames");
 
-      bbCounters = new GlobalVariable(
+      if (counterLayout == FunctionLayout) {
+        allocateCounterRegions(M);
+      }
+      else {
+        // Variable to keep track of the last executed basic block.
+        // The function layout counts the edges at the tail instead.
+        lastBB = new GlobalVariable(
+          M,
+          Type::getInt32Ty(*context),
+          false,
+          GlobalValue::ExternalLinkage,
+          ConstantInt::get(Type::getInt32Ty(*context), 0),
+          "lastBB");
+
+        bbCounters = new GlobalVariable(
+          M,
+          Int1D,
+          false,
+          GlobalValue::ExternalLinkage,
+          init1D,
+          "bbCounters");
+
+        edgeFlags = new GlobalVariable(
+          M,
+          Int2D,
+          false,
+          GlobalVariable::ExternalLinkage,
+          init2D,
+          "edgeFlags");
+
+        edgeCounters = new GlobalVariable(
+          M,
+          Int2D,
+          false,
+          GlobalValue::ExternalLinkage,
+          init2D,
+          "edgeCounters");
+      }
+
+      backEdgeHeads = new GlobalVariable(
         M,
         Int1D,
         false,
         GlobalValue::ExternalLinkage,
         init1D,
-        "bbCounters");
+        "backEdgeHeads");
 
-      edgeFlags = new GlobalVariable(
+      backEdgeTails = new GlobalVariable(
         M,
-        Int2D,
+        Int1D,
         false,
-        GlobalVariable::ExternalLinkage,
-        init2D,
-        "edgeFlags");
+        GlobalValue::ExternalLinkage,
+        init1D,
+        "backEdgeTails");
 
-      edgeCounters = new GlobalVariable(
+      // Every entry belongs to exactly one cycle
+      // so n is enough to hold all of them.
+      cycleEntryArray = new GlobalVariable(
         M,
-        Int2D,
+        Int1D,
         false,
         GlobalValue::ExternalLinkage,
-        init2D,
-        "edgeCounters");
+        init1D,
+        "cycleEntries");
 
-      backEdgeHeads = new GlobalVariable(
+      cycleEntryCycles = new GlobalVariable(
         M,
         Int1D,
         false,
         GlobalValue::ExternalLinkage,
         init1D,
-        "backEdgeHeads");
+        "cycleEntryCycles");
 
-      backEdgeTails = new GlobalVariable(
+      // Every edge goes back to the entry of at most one cycle.
+      ArrayType* IntEdge1D = ArrayType::get(
+        IntegerType::get(*context, 32), std::max(numEdges, 1));
+      ConstantAggregateZero* initEdge1D = ConstantAggregateZero::get(IntEdge1D);
+
+      cycleInsideTails = new GlobalVariable(
         M,
-        Int1D,
+        IntEdge1D,
         false,
         GlobalValue::ExternalLinkage,
-        init1D,
-        "backEdgeTails");
+        initEdge1D,
+        "cycleInsideTails");
+
+      cycleInsideHeads = new GlobalVariable(
+        M,
+        IntEdge1D,
+        false,
+        GlobalValue::ExternalLinkage,
+        initEdge1D,
+        "cycleInsideHeads");
+    }
+
+    GlobalVariable* createConstantArray(
+      Module& M, const std::vector<int>& values, const char* name) {
+      std::vector<uint32_t> data(values.begin(), values.end());
+      Constant* value = ConstantDataArray::get(*context, data);
+      return new GlobalVariable(
+        M,
+        value->getType(),
+        true,
+        GlobalValue::PrivateLinkage,
+        value,
+        name);
+    }
+
+    void computeCounterLayout(Module& M) {
+      bbSlots.assign(bbID.size(), 0);
+      edgeSlots.clear();
+      callTails.clear();
+      callHeads.clear();
+      indirectRanks.clear();
+
+      // Place the hottest function first.
+      std::vector<pair<int, Function*>> functions;
+      for (auto f = M.begin(); f != M.end(); ++f) {
+        if (f->isDeclaration())
+          continue;
+        int count = 0;
+        for (auto bb = f->begin(); bb != f->end(); ++bb) {
+          count += profileCount(f->getName(), bb->getName());
+        }
+        functions.push_back(make_pair(count, f));
+      }
+      std::stable_sort(functions.begin(), functions.end(),
+        [](const pair<int, Function*>& a, const pair<int, Function*>& b) {
+          return a.first > b.first;
+        });
+
+      // <tailID, headID> in the order of the slots,
+      // headID is -1 for the block counter.
+      // The counters executed in the profile go to the hot region,
+      // the others to the cold one.
+      std::vector<pair<int, int>> hot, cold;
+      for (auto x : functions) {
+        Function* f = x.second;
+
+        // <tail, head> -> count
+        std::map<pair<std::string, std::string>, int> edgeCounts;
+        for (auto& e : profileEdges[f->getName().str()]) {
+          edgeCounts[make_pair(e.tail, e.head)] += e.count;
+        }
+
+        std::vector<pair<int, BasicBlock*>> blocks;
+        std::vector<int> targets;
+        for (auto bb = f->begin(); bb != f->end(); ++bb) {
+          blocks.push_back(
+            make_pair(profileCount(f->getName(), bb->getName()), bb));
+
+          auto t = bb->getTerminator();
+          if (!isa<IndirectBrInst>(t))
+            continue;
+          for (int i = 0, m = t->getNumSuccessors(); i < m; ++i) {
+            int headID = bbID[make_pair(
+              f->getName(), t->getSuccessor(i)->getName())];
+            if (indirectRanks.count(headID) == 0) {
+              indirectRanks[headID] = targets.size();
+              targets.push_back(headID);
+            }
+          }
+        }
+        std::stable_sort(blocks.begin(), blocks.end(),
+          [](const pair<int, BasicBlock*>& a, const pair<int, BasicBlock*>& b) {
+            return a.first > b.first;
+          });
+
+        for (auto y : blocks) {
+          BasicBlock* bb = y.second;
+          int tailID = bbID[make_pair(f->getName(), bb->getName())];
+          (y.first > 0 ? hot : cold).push_back(make_pair(tailID, -1));
+
+          // Successors may repeat(e.g. switch cases), count each edge once.
+          std::vector<pair<int, int>> edges;
+          std::set<int> seenHeads;
+          auto t = bb->getTerminator();
+          for (int i = 0, m = t->getNumSuccessors(); i < m; ++i) {
+            BasicBlock* d = t->getSuccessor(i);
+            int headID = bbID[make_pair(f->getName(), d->getName())];
+            if (!seenHeads.insert(headID).second)
+              continue;
+            auto it = edgeCounts.find(
+              make_pair(bb->getName().str(), d->getName().str()));
+            int count = it == edgeCounts.end() ? 0 : it->second;
+            edges.push_back(make_pair(count, headID));
+          }
+          std::stable_sort(edges.begin(), edges.end(),
+            [](const pair<int, int>& a, const pair<int, int>& b) {
+              return a.first > b.first;
+            });
+          if (isa<IndirectBrInst>(t)) {
+            // One slot per rank, the ranks not reached are left unused.
+            for (auto headID : targets) {
+              (y.first > 0 ? hot : cold).push_back(make_pair(tailID,
+                seenHeads.count(headID) ? headID : -2));
+            }
+          }
+          else {
+            for (auto e : edges) {
+              (e.first > 0 ? hot : cold).push_back(
+                make_pair(tailID, e.second));
+            }
+          }
+
+          for (auto inst = bb->begin(); inst != bb->end(); ++inst) {
+            CallInst* call = dyn_cast<CallInst>(inst);
+            if (call == nullptr)
+              continue;
+            Function* callee = call->getCalledFunction();
+            if (callee == nullptr || callee->isDeclaration())
+              continue;
+            callTails.push_back(tailID);
+            callHeads.push_back(bbID[make_pair(
+              callee->getName(), callee->begin()->getName())]);
+          }
+        }
+      }
+
+      // The functions are not padded,
+      // only the cold region starts at a new 64 bytes cache line,
+      // so the hot counters of small functions share the first lines.
+      const int lineSize = 16;
+      int base = 0;
+      for (auto x : hot) {
+        assignSlot(x, base++);
+      }
+      base = (base + lineSize - 1) / lineSize * lineSize;
+      for (auto x : cold) {
+        assignSlot(x, base++);
+      }
+      sinkSlot = base++;
+      numCounters = base;
+    }
+
+    void assignSlot(pair<int, int> x, int slot) {
+      if (x.second == -1)
+        bbSlots[x.first] = slot;
+      else if (x.second >= 0)
+        edgeSlots[x] = slot;
+    }
+
+    void allocateCounterRegions(Module& M) {
+      ArrayType* type = ArrayType::get(
+        IntegerType::get(*context, 32), std::max(numCounters, 1));
+      counterRegions = new GlobalVariable(
+        M,
+        type,
+        false,
+        GlobalValue::ExternalLinkage,
+        ConstantAggregateZero::get(type),
+        "counterRegions");
+      counterRegions->setAlignment(64);
+
+      // Only the report needs these.
+      // The edges are sorted by <tail, head> as in the flat layout.
+      std::vector<int> edgeTails, edgeHeads, slots;
+      for (auto x : edgeSlots) {
+        edgeTails.push_back(x.first.first);
+        edgeHeads.push_back(x.first.second);
+        slots.push_back(x.second);
+      }
+      bbSlotArray = createConstantArray(M, bbSlots, "bbSlots");
+      edgeTailArray = createConstantArray(M, edgeTails, "edgeTails");
+      edgeHeadArray = createConstantArray(M, edgeHeads, "edgeHeads");
+      edgeSlotArray = createConstantArray(M, slots, "edgeSlots");
+      callTailArray = createConstantArray(M, callTails, "callTails");
+      callHeadArray = createConstantArray(M, callHeads, "callHeads");
     }
 
     void allocateStaticStrings(Module& M) {
@@ -269,6 +897,16 @@ namespace {
       return r;
     }
 
+    Value* indexArray1D(
+      IRBuilder<>& builder,
+      GlobalVariable* arr,
+      Value* i) {
+      std::vector<Value*> indices;
+      indices.push_back(zero32);
+      indices.push_back(i);
+      return builder.CreateGEP(arr, indices);
+    }
+
     Value* indexArray2D(
       IRBuilder<>& builder,
       GlobalVariable* arr,
@@ -305,9 +943,6 @@ namespace {
     void invokeDisplay(IRBuilder<>& builder) {
       Constant* pbbFunctionNames = indexArray1D(bbFunctionNameArray, 0);
       Constant* pbbNames = indexArray1D(bbNameArray, 0);
-      Constant* pbbCounters = indexArray1D(bbCounters, 0);
-      Constant* pedgeFlags = indexArray2D(edgeFlags, 0, 0);
-      Constant* pedgeCounters = indexArray2D(edgeCounters, 0, 0);
       Constant* pbackEdgeTails = indexArray1D(backEdgeTails, 0);
       Constant* pbackEdgeHeads = indexArray1D(backEdgeHeads, 0);
 
@@ -317,16 +952,60 @@ namespace {
       ConstantInt* nloop = ConstantInt::get(*context,
         APInt(32, loops.size(), 10));
 
+      Constant* pcycleEntries = indexArray1D(cycleEntryArray, 0);
+      Constant* pcycleEntryCycles = indexArray1D(cycleEntryCycles, 0);
+      Constant* pcycleInsideTails = indexArray1D(cycleInsideTails, 0);
+      Constant* pcycleInsideHeads = indexArray1D(cycleInsideHeads, 0);
+
+      int entries = 0;
+      for (auto& e : cycleEntries) {
+        entries += e.size();
+      }
+      ConstantInt* nentry = ConstantInt::get(*context,
+        APInt(32, entries, 10));
+
+      int insides = 0;
+      for (auto& e : cycleInsideEdges) {
+        insides += e.size();
+      }
+      ConstantInt* ninside = ConstantInt::get(*context,
+        APInt(32, insides, 10));
+
+      ConstantInt* ncycle = ConstantInt::get(*context,
+        APInt(32, cycles.size(), 10));
+
       std::vector<Value*> args;
       args.push_back(pbbFunctionNames);
       args.push_back(pbbNames);
-      args.push_back(pbbCounters);
-      args.push_back(pedgeFlags);
-      args.push_back(pedgeCounters);
+      if (counterLayout == FunctionLayout) {
+        args.push_back(indexArray1D(counterRegions, 0));
+        args.push_back(indexArray1D(bbSlotArray, 0));
+        args.push_back(indexArray1D(edgeTailArray, 0));
+        args.push_back(indexArray1D(edgeHeadArray, 0));
+        args.push_back(indexArray1D(edgeSlotArray, 0));
+        args.push_back(ConstantInt::get(*context,
+          APInt(32, edgeSlots.size(), 10)));
+        args.push_back(indexArray1D(callTailArray, 0));
+        args.push_back(indexArray1D(callHeadArray, 0));
+        args.push_back(ConstantInt::get(*context,
+          APInt(32, callTails.size(), 10)));
+      }
+      else {
+        args.push_back(indexArray1D(bbCounters, 0));
+        args.push_back(indexArray2D(edgeFlags, 0, 0));
+        args.push_back(indexArray2D(edgeCounters, 0, 0));
+      }
       args.push_back(pbackEdgeTails);
       args.push_back(pbackEdgeHeads);
       args.push_back(n);
       args.push_back(nloop);
+      args.push_back(pcycleEntries);
+      args.push_back(pcycleEntryCycles);
+      args.push_back(pcycleInsideTails);
+      args.push_back(pcycleInsideHeads);
+      args.push_back(nentry);
+      args.push_back(ninside);
+      args.push_back(ncycle);
 
       CallInst* call = builder.CreateCall(
         outputFunction, args, "");
@@ -334,6 +1013,11 @@ namespace {
     }
 
     void instrumentFunction(Function& F) {
+      if (counterLayout == FunctionLayout) {
+        instrumentFunctionGrouped(F);
+        return;
+      }
+
       for (auto bb = F.begin(); bb != F.end(); ++bb) {
         int id = bbID[make_pair(functionName, bb->getName())];
 
@@ -341,7 +1025,10 @@ namespace {
           bb->getFirstInsertionPt());
 
         // Mask edgeFlags[tail][head] with 1 to indicate an exist edge.
-        maskEdges(builder, F);
+        // Every executed block implies the entry was executed,
+        // so `-maskentry` gives the same flags.
+        if (!maskEdgesAtEntry || bb == F.begin())
+          maskEdges(builder, F);
 
         // Update basic block counter.
         increaseCounter(builder, indexArray1D(bbCounters, id));
@@ -354,6 +1041,168 @@ namespace {
         // Update last executed basic block.
         ConstantInt* n = ConstantInt::get(*context, APInt(32, id, 10));
         builder.CreateStore(n, lastBB);
+
+        // The callee leaves lastBB pointing to its own blocks.
+        // Restore it after the call so that the edge to the next block
+        // is counted from this block.
+        for (auto inst = bb->begin(); inst != bb->end(); ++inst) {
+          CallInst* call = dyn_cast<CallInst>(inst);
+          if (call == nullptr)
+            continue;
+          Function* callee = call->getCalledFunction();
+          if (callee != nullptr && callee->isDeclaration())
+            continue;
+
+          IRBuilder<> restore(call->getNextNode());
+          restore.CreateStore(n, lastBB);
+        }
+      }
+    }
+
+    void instrumentFunctionGrouped(Function& F) {
+      // Edge blocks are added on the way, so collect the blocks first.
+      std::vector<BasicBlock*> blocks;
+      bool hasLandingPad = false;
+      bool hasIndirectBr = false;
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        blocks.push_back(bb);
+        hasLandingPad |= bb->isLandingPad();
+        hasIndirectBr |= isa<IndirectBrInst>(bb->getTerminator());
+      }
+
+      // Local so that a recursive call or an exception
+      // thrown through another frame cannot clobber it.
+      Type* int32 = Type::getInt32Ty(*context);
+      IRBuilder<> entry(F.getEntryBlock().getFirstInsertionPt());
+      if (hasLandingPad) {
+        landingPadPending = entry.CreateAlloca(
+          int32, nullptr, "landingPadPending");
+      }
+      if (hasIndirectBr) {
+        indirectPending = entry.CreateAlloca(int32, nullptr, "indirectPending");
+        entry.CreateStore(ConstantInt::get(int32, -1), indirectPending);
+      }
+
+      for (auto bb : blocks) {
+        int id = bbID[make_pair(functionName, bb->getName())];
+
+        IRBuilder<> builder(
+          bb->getFirstInsertionPt());
+
+        // Edges are known statically(see edgeTails/edgeHeads)
+        // so there is nothing to mask here.
+
+        // Update basic block counter.
+        increaseCounter(builder, indexArray1D(counterRegions, bbSlots[id]));
+
+        // Count the edge left pending by the tail.
+        if (bb->isLandingPad()) {
+          increaseCounter(builder, indexArray1D(builder, counterRegions,
+            builder.CreateLoad(landingPadPending)));
+        }
+        auto rank = indirectRanks.find(id);
+        if (rank != indirectRanks.end()) {
+          // -1 unless coming from an indirectbr.
+          Value* pending = builder.CreateLoad(indirectPending);
+          Value* slot = builder.CreateSelect(
+            builder.CreateICmpSLT(pending, ConstantInt::get(int32, 0)),
+            ConstantInt::get(int32, sinkSlot),
+            builder.CreateAdd(pending, ConstantInt::get(int32, rank->second)));
+          increaseCounter(builder,
+            indexArray1D(builder, counterRegions, slot));
+          builder.CreateStore(ConstantInt::get(int32, -1), indirectPending);
+        }
+
+        // Update edge counter at the terminator,
+        // so that no lastBB is needed.
+        countEdges(F, bb, id);
+      }
+    }
+
+    int edgeSlot(int tailID, BasicBlock* head) {
+      return edgeSlots[make_pair(tailID,
+        bbID[make_pair(functionName, head->getName())])];
+    }
+
+    void countEdges(Function& F, BasicBlock* bb, int id) {
+      auto t = bb->getTerminator();
+      int n = t->getNumSuccessors();
+      if (n == 0)
+        return;
+
+      BranchInst* br = dyn_cast<BranchInst>(t);
+      if (br != nullptr) {
+        IRBuilder<> builder(t);
+        int slot0 = edgeSlot(id, br->getSuccessor(0));
+        if (br->isUnconditional() || br->getSuccessor(1) == br->getSuccessor(0)) {
+          increaseCounter(builder, indexArray1D(counterRegions, slot0));
+        }
+        else {
+          int slot1 = edgeSlot(id, br->getSuccessor(1));
+          Value* slot = builder.CreateSelect(br->getCondition(),
+            ConstantInt::get(Type::getInt32Ty(*context), slot0),
+            ConstantInt::get(Type::getInt32Ty(*context), slot1));
+          increaseCounter(builder,
+            indexArray1D(builder, counterRegions, slot));
+        }
+        return;
+      }
+
+      // The target of an indirectbr is only known at run time
+      // and the edge cannot be split,
+      // so the slot of rank 0 is left for the target to add its rank.
+      Type* int32 = Type::getInt32Ty(*context);
+      if (isa<IndirectBrInst>(t)) {
+        BasicBlock* d = t->getSuccessor(0);
+        int headID = bbID[make_pair(functionName, d->getName())];
+        IRBuilder<> builder(t);
+        builder.CreateStore(
+          ConstantInt::get(int32, edgeSlot(id, d) - indirectRanks[headID]),
+          indirectPending);
+        return;
+      }
+
+      // Any other terminator(e.g. switch) jumps through a new block
+      // counting the edge.
+      // A landing pad cannot be split,
+      // so the invoke leaves the slot for the landing pad to count.
+      std::vector<BasicBlock*> targets;
+      for (int i = 0; i < n; ++i) {
+        BasicBlock* d = t->getSuccessor(i);
+        if (d->isLandingPad()) {
+          IRBuilder<> builder(t);
+          builder.CreateStore(
+            ConstantInt::get(int32, edgeSlot(id, d)), landingPadPending);
+        }
+        else if (std::find(targets.begin(), targets.end(), d)
+          == targets.end()) {
+          targets.push_back(d);
+        }
+      }
+
+      for (auto d : targets) {
+        BasicBlock* e = BasicBlock::Create(*context, "", &F, d);
+        IRBuilder<> builder(e);
+        increaseCounter(builder,
+          indexArray1D(counterRegions, edgeSlot(id, d)));
+        builder.CreateBr(d);
+
+        for (int i = 0; i < n; ++i) {
+          if (t->getSuccessor(i) == d)
+            t->setSuccessor(i, e);
+        }
+
+        // The phis of the head now get one value from the edge block.
+        for (auto inst = d->begin(); inst != d->end(); ++inst) {
+          PHINode* phi = dyn_cast<PHINode>(inst);
+          if (phi == nullptr)
+            break;
+          phi->setIncomingBlock(phi->getBasicBlockIndex(bb), e);
+          int k;
+          while ((k = phi->getBasicBlockIndex(bb)) >= 0) {
+            phi->removeIncomingValue(k, false);
+          }
+        }
       }
     }
 
@@ -364,6 +1213,7 @@ namespace {
           IRBuilder<> builder(bb->getTerminator());
           buildNameArrays(builder);
           buildLoops(builder);
+          buildCycles(builder);
           invokeDisplay(builder);
           break;
         }
@@ -400,6 +1250,37 @@ namespace {
       }
     }
 
+    void buildCycles(IRBuilder<>& builder) {
+      int k = 0;
+      for (int i = 0; i < (int)cycles.size(); ++i) {
+        for (auto entry : cycleEntries[i]) {
+          builder.CreateStore(
+            ConstantInt::get(*context, APInt(32, entry, 10)),
+            indexArray1D(cycleEntryArray, k));
+
+          builder.CreateStore(
+            ConstantInt::get(*context, APInt(32, i, 10)),
+            indexArray1D(cycleEntryCycles, k));
+          ++k;
+        }
+
+      }
+
+      k = 0;
+      for (auto& edges : cycleInsideEdges) {
+        for (auto e : edges) {
+          builder.CreateStore(
+            ConstantInt::get(*context, APInt(32, e.first, 10)),
+            indexArray1D(cycleInsideTails, k));
+
+          builder.CreateStore(
+            ConstantInt::get(*context, APInt(32, e.second, 10)),
+            indexArray1D(cycleInsideHeads, k));
+          ++k;
+        }
+      }
+    }
+
     void buildNameArrays(IRBuilder<>& builder) {
       for (auto x : bbID) {
         int id = x.second;
@@ -420,6 +1301,10 @@ namespace {
     void preprocessModule(Module& M) {
       currentLoopID = 0;
       loops.clear();
+      currentCycleID = 0;
+      cycles.clear();
+      cycleEntries.clear();
+      cycleInsideEdges.clear();
       tails.clear();
       heads.clear();
 
@@ -433,11 +1318,13 @@ namespace {
       invbbID[id] = "";
       bbID[make_pair("", "")] = id++;
 
+      numEdges = 0;
       for (auto f = M.begin(); f != M.end(); ++f) {
         for (auto bb = f->begin(); bb != f->end(); ++bb) {
           auto k = make_pair(f->getName(), bb->getName());
           invbbID[id] = bb->getName();
           bbID[k] = id++;
+          numEdges += bb->getTerminator()->getNumSuccessors();
         }
       }
     }
@@ -461,64 +1348,77 @@ namespace {
 
     typedef std::map<StringRef, std::set<StringRef>> DomSet;
 
-    std::set<StringRef> intersectPredecessorsDOM(
-      Function::iterator bb, const DomSet& dom) {
-      std::set<StringRef> r;
+    // A predecessor without a set yet stands for the set of all blocks,
+    // so it is skipped.
+    // Return false if no predecessor has a set yet.
+    bool intersectPredecessorsDOM(
+      Function::iterator bb, const DomSet& dom, std::set<StringRef>& r) {
+      bool found = false;
       // Traverse all predessors of one basic block
       // and do the intersection.
       for (auto pred : preds[bb->getName()]) {
-        auto d = dom.find(pred)->second;
-        if (r.empty())
+        auto it = dom.find(pred);
+        if (it == dom.end())
+          continue;
+        const std::set<StringRef>& d = it->second;
+        if (!found) {
           r = d;
+          found = true;
+        }
         else {
           std::set<StringRef> k;
           std::set_intersection(
             r.begin(), r.end(),
             d.begin(), d.end(),
             std::inserter(k, k.begin()));
-          r = k;
+          r.swap(k);
         }
       }
-      return r;
+      return found;
     }
     
     DomSet computeDOMSet(Function& F) {
       // Initialize dominator sets.
+      // Only the entry block starts with a set,
+      // the others stand for the set of all blocks until they get one.
+      // This gives the same result without n sets of n blocks.
       DomSet dom;
-      std::set<StringRef> a;
-      for (auto bb = F.begin(); bb != F.end(); ++bb) {
-        if (bb->getName() == F.getEntryBlock().getName()) {
-          // The entry block dominates itself.
-          std::set<StringRef> s;
-          s.insert(bb->getName());
-          dom[bb->getName()] = s;
-        }
-        // Compute the set of all blocks.
-        a.insert(bb->getName());
-      }
-      for (auto bb = F.begin(); bb != F.end(); ++bb) {
-        if (bb->getName() != F.getEntryBlock().getName()) {
-          // All blocks except the entry
-          // gets the set of all blocks.
-          dom[bb->getName()] = a;
-        }
-      }
+      StringRef entry = F.getEntryBlock().getName();
+      dom[entry].insert(entry);
+
       // Compute dominator sets iteratively
       // until no modification is made.
       bool modified = false;
       do {
         modified = false;
         for (auto bb = F.begin(); bb != F.end(); ++bb) {
-          auto intersection = intersectPredecessorsDOM(bb, dom);
+          std::set<StringRef> intersection;
+          if (!intersectPredecessorsDOM(bb, dom, intersection)
+            && bb->getName() != entry)
+            continue;
           intersection.insert(bb->getName());
-          if (intersection != dom[bb->getName()]) {
-            dom[bb->getName()] = intersection;
+          auto it = dom.find(bb->getName());
+          if (it == dom.end() || intersection != it->second) {
+            dom[bb->getName()].swap(intersection);
             modified = true;
           }
         }
       } while (modified);
 
-      // Output dominator sets.
+      // Unreachable blocks keep the set of all blocks.
+      std::set<StringRef> a;
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        a.insert(bb->getName());
+      }
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        if (dom.find(bb->getName()) == dom.end())
+          dom[bb->getName()] = a;
+      }
+
+      return dom;
+    }
+
+    void outputDOMSet(const DomSet& dom) {
       outs() << SEPARATOR2 << "DOMINATOR SETS:\n";
       for (auto bb : dom) {
         outs() << bb.first << " => ";
@@ -527,8 +1427,6 @@ namespace {
         }
         outs() << "\n";
       }
-      
-      return dom;
     }
 
     std::set<int> computeLoop(const StringRef& s, const StringRef& t) {
@@ -552,15 +1450,14 @@ namespace {
       return r;
     }
 
-    void computeLoops(Function& F) {
-      DomSet dom = computeDOMSet(F);
+    void computeLoops(Function& F, DomSet& dom) {
       // Find back edges.
       for (auto bb = F.begin(); bb != F.end(); ++bb) {
         auto t = bb->getTerminator();
         int n = t->getNumSuccessors();
         for (int i = 0; i < n; ++i) {
           StringRef head = t->getSuccessor(i)->getName();
-          auto d = dom[bb->getName()];
+          auto& d = dom[bb->getName()];
           if (d.find(head) != d.end()) {
             // outs() << bb->getName() << " -> " << head << "\n";
 
@@ -570,8 +1467,9 @@ namespace {
           }
         }
       }
+    }
 
-      // Output loops.
+    void outputLoops() {
       outs() << SEPARATOR2 << "LOOPS: "
         << loops.size() - currentLoopID << "\n";
       for (int j = currentLoopID, size = loops.size(); j < size; ++j) {
@@ -582,6 +1480,398 @@ namespace {
         outs() << "\n";
       }
     }
+
+    // Back edges only find the loops whose header dominates the body.
+    // A cycle entered at more than one block(e.g. jumping into the middle
+    // of a loop with goto) has no such header.
+    // Cycles are found by Havlak's loop nesting forest
+    // (with Ramalingam's correction):
+    // blocks are visited in reverse depth first order,
+    // and the body of the loop headed by w is collected backwards
+    // from the back edges into w.
+    // Inner loops are collapsed into their header by union-find,
+    // so the whole forest costs near-linear time at any nesting depth.
+    // The cycles with more than one entry are kept.
+    void computeCycles(Function& F) {
+      std::vector<BasicBlock*> blocks;
+      DenseMap<BasicBlock*, int> index;
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        index[bb] = blocks.size();
+        blocks.push_back(bb);
+      }
+
+      int n = blocks.size();
+      std::vector<std::vector<int>> succs(n);
+      for (int i = 0; i < n; ++i) {
+        auto t = blocks[i]->getTerminator();
+        for (int j = 0, m = t->getNumSuccessors(); j < m; ++j) {
+          succs[i].push_back(index[t->getSuccessor(j)]);
+        }
+      }
+
+      // Depth first numbering from the entry block.
+      // Unreachable blocks are left out.
+      // From here on blocks are named by their number.
+      std::vector<int> number(n, -1), node;
+      std::vector<int> lastOf(n);
+      // <block, next successor to visit>
+      std::vector<pair<int, int>> frames;
+      number[0] = 0;
+      node.push_back(0);
+      frames.push_back(make_pair(0, 0));
+      while (!frames.empty()) {
+        int v = frames.back().first;
+        if (frames.back().second < (int)succs[v].size()) {
+          int w = succs[v][frames.back().second++];
+          if (number[w] == -1) {
+            number[w] = node.size();
+            node.push_back(w);
+            frames.push_back(make_pair(w, 0));
+          }
+          continue;
+        }
+        lastOf[number[v]] = node.size() - 1;
+        frames.pop_back();
+      }
+
+      int m = node.size();
+      std::vector<int> ids(m);
+      for (int a = 0; a < m; ++a) {
+        ids[a] = bbID[make_pair(functionName, blocks[node[a]]->getName())];
+      }
+      auto isAncestor = [&](int a, int b) {
+        return a <= b && b <= lastOf[a];
+      };
+
+      std::vector<std::vector<int>> preds(m), backPreds(m), nonBackPreds(m);
+      for (int a = 0; a < m; ++a) {
+        for (auto w : succs[node[a]]) {
+          int b = number[w];
+          preds[b].push_back(a);
+          if (isAncestor(b, a))
+            backPreds[b].push_back(a);
+          else
+            nonBackPreds[b].push_back(a);
+        }
+      }
+
+      // header[x] is the innermost loop containing x(-1 for none).
+      std::vector<int> header(m, -1), parent(m), mark(m, -1);
+      std::vector<bool> isHeader(m, false);
+      for (int a = 0; a < m; ++a) {
+        parent[a] = a;
+      }
+      auto find = [&](int a) {
+        int r = a;
+        while (parent[r] != r)
+          r = parent[r];
+        while (parent[a] != r) {
+          int next = parent[a];
+          parent[a] = r;
+          a = next;
+        }
+        return r;
+      };
+
+      for (int w = m - 1; w >= 0; --w) {
+        std::vector<int> body;
+        for (auto v : backPreds[w]) {
+          isHeader[w] = true;
+          if (v == w)
+            continue;
+          int x = find(v);
+          if (mark[x] != w) {
+            mark[x] = w;
+            body.push_back(x);
+          }
+        }
+
+        std::vector<int> worklist(body);
+        while (!worklist.empty()) {
+          int x = worklist.back();
+          worklist.pop_back();
+          for (auto y : nonBackPreds[x]) {
+            int z = find(y);
+            if (!isAncestor(w, z)) {
+              // Entering the loop not through w, it is irreducible.
+              // The edge is kept for the enclosing loops.
+              nonBackPreds[w].push_back(z);
+            }
+            else if (z != w && mark[z] != w) {
+              mark[z] = w;
+              body.push_back(z);
+              worklist.push_back(z);
+            }
+          }
+        }
+
+        for (auto x : body) {
+          header[x] = w;
+          parent[x] = w;
+        }
+      }
+
+      // Number the loop nesting tree
+      // so that the blocks of a loop l are [begin[l], end[l]) in treeOrder.
+      std::vector<std::vector<int>> children(m);
+      std::vector<int> roots;
+      for (int a = 0; a < m; ++a) {
+        if (header[a] == -1)
+          roots.push_back(a);
+        else
+          children[header[a]].push_back(a);
+      }
+
+      std::vector<int> treeOrder, begin(m), end(m);
+      for (auto root : roots) {
+        begin[root] = treeOrder.size();
+        treeOrder.push_back(root);
+        frames.push_back(make_pair(root, 0));
+        while (!frames.empty()) {
+          int v = frames.back().first;
+          if (frames.back().second < (int)children[v].size()) {
+            int c = children[v][frames.back().second++];
+            begin[c] = treeOrder.size();
+            treeOrder.push_back(c);
+            frames.push_back(make_pair(c, 0));
+            continue;
+          }
+          end[v] = treeOrder.size();
+          frames.pop_back();
+        }
+      }
+      auto inLoop = [&](int l, int a) {
+        return begin[l] <= begin[a] && begin[a] < end[l];
+      };
+
+      // An entry of a loop is a block of it reached from outside of it.
+      // An edge enters the loops from the innermost one of the head
+      // up to the first one containing the tail,
+      // so this costs one step per entry found.
+      // The entry block of the function is reached from the caller.
+      std::vector<std::vector<int>> entries(m);
+      auto enter = [&](int a, int b) {
+        int l = isHeader[b] ? b : header[b];
+        while (l != -1 && (a == -1 || !inLoop(l, a))) {
+          if (entries[l].empty() || entries[l].back() != b)
+            entries[l].push_back(b);
+          l = header[l];
+        }
+      };
+      enter(-1, 0);
+      for (int b = 0; b < m; ++b) {
+        for (auto a : preds[b]) {
+          enter(a, b);
+        }
+      }
+
+      // Outer cycles come first.
+      for (auto l : treeOrder) {
+        if (entries[l].size() < 2)
+          continue;
+
+        std::vector<int> members, entryIDs;
+        for (int i = begin[l]; i < end[l]; ++i) {
+          members.push_back(ids[treeOrder[i]]);
+        }
+
+        // Edges going back to an entry from inside of the cycle.
+        std::set<pair<int, int>> inside;
+        for (auto b : entries[l]) {
+          entryIDs.push_back(ids[b]);
+          for (auto a : preds[b]) {
+            if (inLoop(l, a))
+              inside.insert(make_pair(ids[a], ids[b]));
+          }
+        }
+
+        std::sort(members.begin(), members.end());
+        std::sort(entryIDs.begin(), entryIDs.end());
+        cycles.push_back(members);
+        cycleEntries.push_back(entryIDs);
+        cycleInsideEdges.push_back(
+          std::vector<pair<int, int>>(inside.begin(), inside.end()));
+      }
+    }
+
+    void outputCycles() {
+      outs() << SEPARATOR2 << "IRREDUCIBLE CYCLES: "
+        << cycles.size() - currentCycleID << "\n";
+      for (int j = currentCycleID, size = cycles.size(); j < size; ++j) {
+        outs() << "cycle" << j << ": (entries: ";
+        for (auto i : cycleEntries[j]) {
+          outs() << invbbID[i] << " ";
+        }
+        outs() << ") ";
+        for (auto i : cycles[j]) {
+          outs() << invbbID[i] << ", ";
+        }
+        outs() << "\n";
+      }
+    }
+
+    // Cache file of a function, named by the MD5 of its CFG
+    // (block names and successors) and the pass options.
+    // Unlike the printed IR it does not change
+    // when other functions are edited.
+    // Empty if the cache is disabled.
+    std::string getCacheFilename(Function& F) {
+      if (cacheDirectory.empty())
+        return "";
+
+      // The dominators only depend on the CFG,
+      // so no option goes into the key.
+      MD5 hash;
+      hash.update("CS201Profiling cache v3\n");
+
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        hash.update(bb->getName());
+        hash.update(":");
+        auto t = bb->getTerminator();
+        for (int i = 0, n = t->getNumSuccessors(); i < n; ++i) {
+          hash.update(" ");
+          hash.update(t->getSuccessor(i)->getName());
+        }
+        hash.update("\n");
+      }
+
+      MD5::MD5Result result;
+      hash.final(result);
+      SmallString<32> digest;
+      MD5::stringifyResult(result, digest);
+
+      return cacheDirectory + "/" + digest.str().str() + ".cache";
+    }
+
+    // dom(bb) = {bb} + dom(idom(bb))
+    // Return false if idom does not describe a tree rooted at entry.
+    bool buildDOMSet(
+      Function& F,
+      const std::map<StringRef, StringRef>& idom,
+      DomSet& dom) {
+      dom.clear();
+      int n = F.size();
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        // Walk up until a block with a known set.
+        std::vector<StringRef> path;
+        StringRef x = bb->getName();
+        while (dom.find(x) == dom.end()) {
+          path.push_back(x);
+          auto it = idom.find(x);
+          if (it == idom.end() || (int)path.size() > n)
+            return false;
+          if (it->second.empty())
+            break;
+          x = it->second;
+        }
+
+        std::set<StringRef> s;
+        if (dom.find(x) != dom.end())
+          s = dom[x];
+        for (auto y = path.rbegin(); y != path.rend(); ++y) {
+          s.insert(*y);
+          dom[*y] = s;
+        }
+      }
+      return true;
+    }
+
+    // Only the immediate dominators are saved(one name per block).
+    // Loops and cycles are cheap to find again from the dominator sets.
+    // Nothing is saved if the sets cannot be rebuilt from them,
+    // e.g. for unreachable blocks.
+    void saveAnalysis(
+      const std::string& filename,
+      Function& F,
+      const DomSet& dom) {
+      // The immediate dominator is the strict dominator
+      // dominated by all the others, i.e. the one with the largest set.
+      std::map<StringRef, StringRef> idom;
+      for (auto bb : dom) {
+        StringRef best;
+        int size = 0;
+        for (auto d : bb.second) {
+          if (d == bb.first)
+            continue;
+          int k = dom.find(d)->second.size();
+          if (k > size) {
+            best = d;
+            size = k;
+          }
+        }
+        idom[bb.first] = best;
+      }
+
+      DomSet rebuilt;
+      if (!buildDOMSet(F, idom, rebuilt) || rebuilt != dom)
+        return;
+
+      // Write a unique file and rename it into place,
+      // so that parallel builds sharing the directory
+      // never read a half written file.
+      int fd;
+      SmallString<128> tmp;
+      if (sys::fs::createUniqueFile(filename + ".%%%%%%.tmp", fd, tmp))
+        return;
+
+      {
+        raw_fd_ostream out(fd, true);
+        for (auto bb = F.begin(); bb != F.end(); ++bb) {
+          out << bb->getName();
+          StringRef d = idom[bb->getName()];
+          if (!d.empty())
+            out << " " << d;
+          out << "\n";
+        }
+
+        // Mark a complete file.
+        out << "END\n";
+      }
+
+      if (sys::fs::rename(tmp.str(), filename))
+        sys::fs::remove(tmp.str());
+    }
+
+    // Return false on a missing or broken cache file.
+    bool loadAnalysis(const std::string& filename, Function& F, DomSet& dom) {
+      std::ifstream in(filename.c_str());
+      if (!in)
+        return false;
+
+      // Map the names back to the ones owned by the IR.
+      std::map<std::string, StringRef> names;
+      for (auto bb = F.begin(); bb != F.end(); ++bb) {
+        names[bb->getName().str()] = bb->getName();
+      }
+
+      std::map<StringRef, StringRef> idom;
+      std::string line;
+      bool complete = false;
+      while (std::getline(in, line)) {
+        if (line == "END") {
+          complete = true;
+          break;
+        }
+
+        std::istringstream is(line);
+        std::string bb, d;
+        is >> bb >> d;
+        if (names.find(bb) == names.end())
+          return false;
+        if (d.empty()) {
+          idom[names[bb]] = StringRef();
+        }
+        else {
+          if (names.find(d) == names.end())
+            return false;
+          idom[names[bb]] = names[d];
+        }
+      }
+
+      if (!complete || idom.size() != F.size())
+        return false;
+      return buildDOMSet(F, idom, dom);
+    }
   };
 }
 
@@ -0,0 +1,175 @@
+# Benchmark the Pass on synthetic modules generated by support/gencfg.cpp.
+#
+# $ ./benchmark.sh                      # run and write bench_output.txt
+# $ ./benchmark.sh old_output.txt       # also compare against old results
+#
+# Each line of bench_output.txt(CSV) is one configuration:
+#   compile_time  seconds spent in opt
+#   peak_mem      peak resident memory of opt in KB
+#   binary_size   size of the instrumented executable in bytes
+#   base_time     run time of the uninstrumented executable in seconds
+#   instr_time    run time of the instrumented executable in seconds,
+#                 excluding report_time
+#   overhead      instr_time / base_time
+#   report_time   wall clock seconds spent in outputProfilingResult
+#   cache_cold_time  wall clock seconds spent in opt -cachedir
+#                    with an empty cache directory
+#   cache_warm_time  the same run again with the cache filled
+#
+# main calls every function `repeat` times
+# so that the run time is long enough to measure.
+#
+# The flat layout allocates two n x n matrices(n is the number of blocks),
+# so it is skipped for the configurations with more than
+# MAX_FLAT_BLOCKS blocks(estimated by functions x blocks).
+# `huge` is a single function of 10000 blocks with nested cycles
+# to check that the analysis scales, run it with -counterlayout=function.
+# A configuration failing to build is reported and skipped.
+#
+# Extra options of the Pass can be given by OPT_FLAGS, e.g.
+# $ ./benchmark.sh && mv bench_output.txt flat.txt
+# $ OPT_FLAGS=-counterlayout=function ./benchmark.sh flat.txt
+# (see README 7 to measure the flat layout with -maskentry as well)
+#
+# When old results are given,
+# any metric growing by more than THRESHOLD percent is reported
+# and the script exits with 1.
+
+BASELINE=${1}
+OUTPUT=${OUTPUT:-bench_output.txt}
+THRESHOLD=${THRESHOLD:-10}
+MAX_FLAT_BLOCKS=${MAX_FLAT_BLOCKS:-4096}
+LLVM_HOME=~/Workspace
+PREFIX=Release+Asserts
+BIN=${LLVM_HOME}/llvm/${PREFIX}/bin
+if [ $(uname -s) == "Darwin" ]; then
+    SHARED_LIB_EXT=dylib;
+    TIME="gtime";
+    DATE="gdate";
+else
+    SHARED_LIB_EXT=so;
+    TIME="/usr/bin/time";
+    DATE="date";
+fi
+
+# name functions blocks depth irreducible fanout repeat
+CONFIGS=${CONFIGS:-"
+small 4 20 1 0 0 500000
+wide 150 20 1 0 4 15000
+deep 10 50 4 0 0 2000
+irreducible 10 50 1 8 0 75000
+switch 10 50 1 0 64 200000
+large 20 1000 2 4 16 600
+cache 60 60 2 0 8 3500
+huge 1 10000 2 32 16 400
+"}
+
+# Wall clock time of a command in seconds.
+# The output of the command is discarded
+# and its exit status is returned.
+elapsed() {
+    local START=$(${DATE} +%s%N)
+    "$@" > /dev/null
+    local STATUS=$?
+    local END=$(${DATE} +%s%N)
+    awk -v a=${START} -v b=${END} 'BEGIN { printf "%.3f", (b - a) / 1e9 }'
+    return ${STATUS}
+}
+
+BENCH=support/bench
+mkdir -p ${BENCH}
+
+make && \
+    ${BIN}/clang++ -std=c++11 -o ${BENCH}/gencfg support/gencfg.cpp && \
+    ${BIN}/clang++ -std=c++11 -c -emit-llvm -o ${BENCH}/utility.bc support/utility.cpp || exit 1
+
+echo "name,compile_time,peak_mem,binary_size,base_time,instr_time,overhead,report_time,cache_cold_time,cache_warm_time" > ${OUTPUT}
+
+while read NAME FUNCTIONS BLOCKS DEPTH IRREDUCIBLE FANOUT REPEAT; do
+    if [ -z "${NAME}" ]; then
+        continue;
+    fi
+
+    if [ $((FUNCTIONS * BLOCKS)) -gt ${MAX_FLAT_BLOCKS} ] && \
+        [[ "${OPT_FLAGS}" != *-counterlayout=function* ]]; then
+        echo "Skipping ${NAME}: too many blocks for the flat layout" >&2
+        continue;
+    fi
+
+    echo "Running ${NAME}"
+    P=${BENCH}/${NAME}
+    if ! ( ${BENCH}/gencfg ${FUNCTIONS} ${BLOCKS} ${DEPTH} ${IRREDUCIBLE} \
+            ${FANOUT} ${REPEAT} > ${P}.c && \
+        ${BIN}/clang -emit-llvm -c ${P}.c -o ${P}.bc && \
+        ${BIN}/clang ${P}.bc -o ${P}.base ); then
+        echo "Skipping ${NAME}: cannot build the module" >&2
+        continue;
+    fi
+
+    # Pass compile time and peak memory.
+    if ! ${TIME} -f "%e %M" -o ${P}.opt.time \
+        ${BIN}/opt -load ../../../${PREFIX}/lib/CS201Profiling.${SHARED_LIB_EXT} \
+        -pathProfiling ${OPT_FLAGS} ${P}.bc -o ${P}.bb.bc > /dev/null; then
+        echo "Skipping ${NAME}: the Pass failed" >&2
+        continue;
+    fi
+    read COMPILE_TIME PEAK_MEM < ${P}.opt.time
+
+    # Compile time with the analysis cache(README 8),
+    # first filling the cache then reading it.
+    rm -rf ${P}.cache
+    if ! CACHE_COLD_TIME=$(elapsed ${BIN}/opt \
+            -load ../../../${PREFIX}/lib/CS201Profiling.${SHARED_LIB_EXT} \
+            -pathProfiling ${OPT_FLAGS} -cachedir ${P}.cache ${P}.bc -o ${P}.cache.bc) || \
+        ! CACHE_WARM_TIME=$(elapsed ${BIN}/opt \
+            -load ../../../${PREFIX}/lib/CS201Profiling.${SHARED_LIB_EXT} \
+            -pathProfiling ${OPT_FLAGS} -cachedir ${P}.cache ${P}.bc -o ${P}.cache.bc); then
+        echo "Skipping ${NAME}: the Pass failed with -cachedir" >&2
+        continue;
+    fi
+
+    if ! ( ${BIN}/llvm-link ${P}.bb.bc ${BENCH}/utility.bc -o ${P}.main.bc && \
+        ${BIN}/clang++ ${P}.main.bc -o ${P}.instr ); then
+        echo "Skipping ${NAME}: cannot build the instrumented module" >&2
+        continue;
+    fi
+    BINARY_SIZE=$(wc -c < ${P}.instr | tr -d ' ')
+
+    # Run time of both builds.
+    # The report is not part of the counting overhead.
+    # Both are wall clock times.
+    if ! BASE_TIME=$(elapsed ${P}.base) || \
+        ! TOTAL_TIME=$(CS201PROFILING_REPORT_TIME=1 CS201PROFILING_OUTPUT=${P}.prof \
+            elapsed ${P}.instr 2> ${P}.report); then
+        echo "Skipping ${NAME}: the executable failed" >&2
+        continue;
+    fi
+    REPORT_TIME=$(sed -n 's/^REPORT TIME: //p' ${P}.report)
+    INSTR_TIME=$(awk -v a=${TOTAL_TIME} -v b=${REPORT_TIME:-0} \
+        'BEGIN { printf "%.3f", a - b }')
+    OVERHEAD=$(awk -v a=${INSTR_TIME} -v b=${BASE_TIME} \
+        'BEGIN { if (b > 0) printf "%.3f", a / b; else print "nan" }')
+
+    echo "${NAME},${COMPILE_TIME},${PEAK_MEM},${BINARY_SIZE},${BASE_TIME},${INSTR_TIME},${OVERHEAD},${REPORT_TIME},${CACHE_COLD_TIME},${CACHE_WARM_TIME}" >> ${OUTPUT}
+done <<< "${CONFIGS}"
+
+cat ${OUTPUT}
+
+if [ -n "${BASELINE}" ]; then
+    # base_time is not a property of the Pass so it is not compared.
+    awk -F, -v threshold=${THRESHOLD} '
+        FNR == 1 { for (i = 1; i <= NF; ++i) column[i] = $i; next }
+        NR == FNR { for (i = 2; i <= NF; ++i) old[$1, i] = $i; next }
+        {
+            for (i = 2; i <= NF; ++i) {
+                if (column[i] == "base_time" || !(($1, i) in old))
+                    continue;
+                if (old[$1, i] > 0 && $i > old[$1, i] * (1 + threshold / 100)) {
+                    printf "REGRESSION %s %s: %s -> %s\n", $1, column[i], old[$1, i], $i;
+                    regressed = 1;
+                }
+            }
+        }
+        END { exit regressed }
+    ' ${BASELINE} ${OUTPUT}
+fi
@@ -14,5 +14,11 @@ clang -emit-llvm support/${INPUT}.c -c -o support/${INPUT}.bc && \
     ${LLVM_HOME}/llvm/${PREFIX}/bin/opt -load ../../../${PREFIX}/lib/CS201Profiling.${SHARED_LIB_EXT} -pathProfiling support/${INPUT}.bc -S -o support/${INPUT}.ll && \
     ${LLVM_HOME}/llvm/${PREFIX}/bin/llvm-as support/${INPUT}.ll -o support/${INPUT}.bb.bc && \
     ${LLVM_HOME}/llvm/${PREFIX}/bin/llvm-link support/${INPUT}.bb.bc support/utility.bc -o support/${INPUT}.main.bc && \
-    ${LLVM_HOME}/llvm/${PREFIX}/bin/lli support/${INPUT}.main.bc
+    ${LLVM_HOME}/llvm/${PREFIX}/bin/lli support/${INPUT}.main.bc || exit 1
+
+# $ ./buildAndTest.sh 6 layout
+# also feeds the profile of the run back to report the layout.
+if [ "${2}" == "layout" ]; then
+    ${LLVM_HOME}/llvm/${PREFIX}/bin/opt -load ../../../${PREFIX}/lib/CS201Profiling.${SHARED_LIB_EXT} -pathProfiling -profile CS201Profiling.prof -layout support/${INPUT}.bc -S -o support/${INPUT}.layout.ll
+fi
 
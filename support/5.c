@@ -0,0 +1,25 @@
+void function_1(unsigned x) {
+    unsigned i = 0;
+    unsigned n;
+
+    while (i < 10) {
+        n = x;
+        if (i % 2) goto ODD;
+
+    EVEN:
+        if (n == 0) goto DONE;
+        --n;
+    ODD:
+        if (n == 0) goto DONE;
+        --n;
+        goto EVEN;
+
+    DONE:
+        ++i;
+    }
+}
+
+int main() {
+    function_1(5);
+    return 0;
+}
@@ -0,0 +1,23 @@
+unsigned unused(unsigned x) {
+    return x - 1;
+}
+
+unsigned cold(unsigned x) {
+    return x * 3;
+}
+
+unsigned hot(unsigned x) {
+    if (x % 8 == 0)
+        x = cold(x);
+    else
+        x = x + 1;
+    return x;
+}
+
+int main() {
+    unsigned i;
+    unsigned x = 0;
+    for (i = 0; i < 100; ++i)
+        x = x + hot(i);
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Generate a synthetic C module to benchmark the Pass.
+//
+// Usage: gencfg <functions> <blocks> <depth> <irreducible> <fanout>
+//          [repeat] [seed]
+//   functions    number of functions besides main
+//   blocks       approximate number of basic blocks per function
+//   depth        loop nesting depth in each function
+//   irreducible  number of two-entry cycles in each function
+//   fanout       number of cases of each switch(0 for no switch)
+//   repeat       number of times main calls every function
+//   seed         seed of the random number generator
+//
+// The module is written to the standard output.
+
+#include <cstdio>
+#include <cstdlib>
+using namespace std;
+
+static unsigned seed = 1;
+
+static unsigned nextRandom() {
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+static void indent(int level) {
+  for (int i = 0; i < level; ++i)
+    printf("  ");
+}
+
+// Emit a straight `if` and return the number of blocks it creates.
+static int emitBranch(int level) {
+  indent(level);
+  printf("if (x & %u) x += %u; else x ^= %u;\n",
+    1u << (nextRandom() % 8), nextRandom() % 17, nextRandom() % 31);
+  return 3;
+}
+
+static int emitSwitch(int level, int fanout) {
+  indent(level);
+  printf("switch (x %% %d) {\n", fanout + 1);
+  for (int i = 0; i < fanout; ++i) {
+    indent(level);
+    printf("case %d: x = x * %u + %d; break;\n", i, nextRandom() % 7 + 1, i);
+  }
+  indent(level);
+  printf("default: x >>= 1; break;\n");
+  indent(level);
+  printf("}\n");
+  return fanout + 2;
+}
+
+// A cycle with two entries, A and B, in the goto style of support/2.c.
+static int emitIrreducible(int level, int id) {
+  indent(level);
+  printf("n = %u;\n", nextRandom() % 8 + 2);
+  indent(level);
+  printf("if (x & 1) goto IRR_B_%d;\n", id);
+  printf("IRR_A_%d:\n", id);
+  indent(level);
+  printf("x += %u;\n", nextRandom() % 13);
+  indent(level);
+  printf("if (--n == 0) goto IRR_EXIT_%d;\n", id);
+  printf("IRR_B_%d:\n", id);
+  indent(level);
+  printf("x ^= %u;\n", nextRandom() % 29);
+  indent(level);
+  printf("if (--n == 0) goto IRR_EXIT_%d;\n", id);
+  indent(level);
+  printf("goto IRR_A_%d;\n", id);
+  printf("IRR_EXIT_%d:\n", id);
+  indent(level);
+  printf(";\n");
+  return 6;
+}
+
+static void emitFunction(int f, int blocks, int depth,
+  int irreducible, int fanout) {
+  printf("unsigned function_%d(unsigned x) {\n", f);
+  printf("  unsigned n;\n");
+  for (int d = 0; d < depth; ++d)
+    printf("  unsigned i%d;\n", d);
+
+  int emitted = 1;
+  int level = 1;
+  for (int d = 0; d < depth; ++d) {
+    indent(level);
+    printf("for (i%d = 0; i%d < %u; ++i%d) {\n",
+      d, d, nextRandom() % 4 + 2, d);
+    emitted += 4;
+    ++level;
+  }
+
+  for (int i = 0; i < irreducible; ++i)
+    emitted += emitIrreducible(level, i);
+
+  if (fanout > 0)
+    emitted += emitSwitch(level, fanout);
+
+  while (emitted < blocks)
+    emitted += emitBranch(level);
+
+  while (level > 1) {
+    --level;
+    indent(level);
+    printf("}\n");
+  }
+
+  printf("  return x;\n");
+  printf("}\n\n");
+}
+
+int main(int argc, char** argv) {
+  if (argc < 6) {
+    fprintf(stderr,
+      "Usage: %s <functions> <blocks> <depth> <irreducible> <fanout> "
+      "[repeat] [seed]\n",
+      argv[0]);
+    return 1;
+  }
+
+  int functions = atoi(argv[1]);
+  int blocks = atoi(argv[2]);
+  int depth = atoi(argv[3]);
+  int irreducible = atoi(argv[4]);
+  int fanout = atoi(argv[5]);
+  int repeat = 1;
+  if (argc > 6)
+    repeat = atoi(argv[6]);
+  if (argc > 7)
+    seed = atoi(argv[7]);
+
+  printf("// gencfg %d %d %d %d %d %d %u\n\n",
+    functions, blocks, depth, irreducible, fanout, repeat, seed);
+
+  for (int f = 0; f < functions; ++f)
+    emitFunction(f, blocks, depth, irreducible, fanout);
+
+  printf("volatile unsigned sink;\n\n");
+  printf("int main() {\n");
+  printf("  unsigned x = 1;\n");
+  printf("  unsigned r;\n");
+  // Repeat the calls so that the run time is long enough to measure.
+  printf("  for (r = 0; r < %d; ++r) {\n", repeat);
+  for (int f = 0; f < functions; ++f)
+    printf("    x = function_%d(x);\n", f);
+  printf("  }\n");
+  printf("  sink = x;\n");
+  printf("  return 0;\n");
+  printf("}\n");
+  return 0;
+}
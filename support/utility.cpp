@@ -1,24 +1,87 @@
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
+#include <time.h>
 #include <typeinfo>
+#include <vector>
 #include <algorithm>
 using namespace std;
 
 #define SEPARATOR "---------------------------\n"
+#define PROFILE_FILENAME "CS201Profiling.prof"
 
-extern "C" void outputProfilingResult(
+// Wall clock time in seconds.
+// benchmark.sh subtracts the report from the wall clock run time,
+// so CPU time(clock()) would mix the units.
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+struct Edge {
+  int tail, head, count;
+};
+
+static bool operator<(const Edge& a, const Edge& b) {
+  return a.tail != b.tail ? a.tail < b.tail : a.head < b.head;
+}
+
+// Write the raw counters so that the pass can read them back
+// with `-profile` (e.g. to compute a block layout).
+// Every executed edge is written, including the ones across functions.
+static void writeProfile(
   const char** bbFunctionNames,
   const char** bbNames,
-  int* bbCounters,
-  int* edgeFlagsFlat,
-  int* edgeCountersFlat,
-  int* backEdgeTails,
-  int* backEdgeHeads,
-  int n, int nloop) {
+  const int* bbCounters,
+  const vector<Edge>& edges,
+  int n) {
+  const char* filename = getenv("CS201PROFILING_OUTPUT");
+  if (filename == nullptr)
+    filename = PROFILE_FILENAME;
 
-  auto edgeCounters = reinterpret_cast<int (*)[n]>(edgeCountersFlat);
-  auto edgeFlags = reinterpret_cast<int (*)[n]>(edgeFlagsFlat);
+  FILE* f = fopen(filename, "w");
+  if (f == nullptr) {
+    fprintf(stderr, "Cannot write profile %s\n", filename);
+    return;
+  }
+
+  for (int id = 1; id < n; ++id) {
+    fprintf(f, "BB %s %s %d\n",
+      bbFunctionNames[id], bbNames[id], bbCounters[id]);
+  }
+
+  for (auto& e : edges) {
+    if (e.count == 0)
+      continue;
+
+    fprintf(f, "EDGE %s %s %s %s %d\n",
+      bbFunctionNames[e.tail], bbNames[e.tail],
+      bbFunctionNames[e.head], bbNames[e.head],
+      e.count);
+  }
 
+  fclose(f);
+}
+
+// Shared by both layouts.
+// `edges` are the edges of the CFGs sorted by <tail, head>,
+// `profileEdges` also include the calls across functions.
+static void outputReport(
+  double start,
+  const char** bbFunctionNames,
+  const char** bbNames,
+  const int* bbCounters,
+  const vector<Edge>& edges,
+  const vector<Edge>& profileEdges,
+  int* backEdgeTails,
+  int* backEdgeHeads,
+  int n, int nloop,
+  int* cycleEntries,
+  int* cycleEntryCycles,
+  int* cycleInsideTails,
+  int* cycleInsideHeads,
+  int nentry, int ninside, int ncycle) {
   printf("\nBASIC BLOCK PROFILING:\n");
   const char* prev = "";
   for (int id = 1; id < n; ++id) {
@@ -33,20 +96,15 @@ extern "C" void outputProfilingResult(
 
   printf("\nEDGE PROFILING:\n");
   prev = "";
-  for (int i = 1; i < n; ++i) {
-    for (int j = 1; j < n; ++j) {
-      if (edgeFlags[i][j] == 0)
-        continue;
-
-      if (strcmp(prev, bbFunctionNames[i]) != 0) {
-        printf(SEPARATOR);
-        printf("FUNCTION %s\n", bbFunctionNames[i]);
-        prev = bbFunctionNames[i];
-      }
-
-      printf("%s (ID: %d) -> %s (ID: %d): %d\n",
-        bbNames[i], i, bbNames[j], j, edgeCounters[i][j]);
+  for (auto& e : edges) {
+    if (strcmp(prev, bbFunctionNames[e.tail]) != 0) {
+      printf(SEPARATOR);
+      printf("FUNCTION %s\n", bbFunctionNames[e.tail]);
+      prev = bbFunctionNames[e.tail];
     }
+
+    printf("%s (ID: %d) -> %s (ID: %d): %d\n",
+      bbNames[e.tail], e.tail, bbNames[e.head], e.head, e.count);
   }
 
   printf("\nLOOP PROFILING:\n");
@@ -63,5 +121,149 @@ extern "C" void outputProfilingResult(
     int count = min(bbCounters[tail], bbCounters[head]);
     printf("loop%d: %d\n", i, count);
   }
+
+  // A cycle is entered from outside through one of its entries,
+  // and iterates whenever the control goes back to an entry from inside.
+  printf("\nIRREDUCIBLE CYCLE PROFILING:\n");
+  vector<int> inside(n);
+  for (int i = 0; i < ninside; ++i) {
+    Edge key = { cycleInsideTails[i], cycleInsideHeads[i], 0 };
+    auto e = lower_bound(edges.begin(), edges.end(), key);
+    if (e != edges.end() && !(key < *e))
+      inside[key.head] += e->count;
+  }
+
+  prev = "";
+  for (int c = 0, k = 0; c < ncycle; ++c) {
+    if (strcmp(prev, bbFunctionNames[cycleEntries[k]]) != 0) {
+      printf(SEPARATOR);
+      printf("FUNCTION %s\n", bbFunctionNames[cycleEntries[k]]);
+      prev = bbFunctionNames[cycleEntries[k]];
+    }
+
+    int begin = k;
+    int iterations = 0;
+    for (; k < nentry && cycleEntryCycles[k] == c; ++k) {
+      iterations += inside[cycleEntries[k]];
+    }
+    printf("cycle%d: %d\n", c, iterations);
+
+    for (int j = begin; j < k; ++j) {
+      int entry = cycleEntries[j];
+      printf("  entry %s (ID: %d): %d\n",
+        bbNames[entry], entry, bbCounters[entry] - inside[entry]);
+    }
+  }
+
+  writeProfile(bbFunctionNames, bbNames, bbCounters, profileEdges, n);
+
+  // Used by benchmark.sh.
+  if (getenv("CS201PROFILING_REPORT_TIME") != nullptr) {
+    fprintf(stderr, "REPORT TIME: %f\n",
+      now() - start);
+  }
 }
 
+extern "C" void outputProfilingResult(
+  const char** bbFunctionNames,
+  const char** bbNames,
+  int* bbCounters,
+  int* edgeFlagsFlat,
+  int* edgeCountersFlat,
+  int* backEdgeTails,
+  int* backEdgeHeads,
+  int n, int nloop,
+  int* cycleEntries,
+  int* cycleEntryCycles,
+  int* cycleInsideTails,
+  int* cycleInsideHeads,
+  int nentry, int ninside, int ncycle) {
+  double start = now();
+
+  auto edgeCounters = reinterpret_cast<int (*)[n]>(edgeCountersFlat);
+  auto edgeFlags = reinterpret_cast<int (*)[n]>(edgeFlagsFlat);
+
+  vector<Edge> edges, profileEdges;
+  for (int i = 1; i < n; ++i) {
+    for (int j = 1; j < n; ++j) {
+      Edge e = { i, j, edgeCounters[i][j] };
+      if (edgeFlags[i][j] != 0)
+        edges.push_back(e);
+      if (e.count != 0)
+        profileEdges.push_back(e);
+    }
+  }
+
+  outputReport(
+    start,
+    bbFunctionNames, bbNames,
+    bbCounters, edges, profileEdges,
+    backEdgeTails, backEdgeHeads,
+    n, nloop,
+    cycleEntries, cycleEntryCycles, cycleInsideTails, cycleInsideHeads,
+    nentry, ninside, ncycle);
+}
+
+// Used by `-counterlayout=function`.
+// The counters are read through the tables of slots,
+// so the report is linear in the number of blocks and edges.
+// A call edge is counted by the block of the call.
+extern "C" void outputGroupedProfilingResult(
+  const char** bbFunctionNames,
+  const char** bbNames,
+  int* counterRegions,
+  int* bbSlots,
+  int* edgeTails,
+  int* edgeHeads,
+  int* edgeSlots,
+  int nedge,
+  int* callTails,
+  int* callHeads,
+  int ncall,
+  int* backEdgeTails,
+  int* backEdgeHeads,
+  int n, int nloop,
+  int* cycleEntries,
+  int* cycleEntryCycles,
+  int* cycleInsideTails,
+  int* cycleInsideHeads,
+  int nentry, int ninside, int ncycle) {
+  double start = now();
+
+  vector<int> bbCounters(n);
+  for (int id = 1; id < n; ++id) {
+    bbCounters[id] = counterRegions[bbSlots[id]];
+  }
+
+  // The edges are already sorted by the pass.
+  vector<Edge> edges;
+  for (int i = 0; i < nedge; ++i) {
+    Edge e = { edgeTails[i], edgeHeads[i], counterRegions[edgeSlots[i]] };
+    edges.push_back(e);
+  }
+
+  // Merge the call edges and the calls repeated in one block.
+  vector<Edge> profileEdges(edges);
+  for (int i = 0; i < ncall; ++i) {
+    Edge e = { callTails[i], callHeads[i], bbCounters[callTails[i]] };
+    profileEdges.push_back(e);
+  }
+  sort(profileEdges.begin(), profileEdges.end());
+  int m = 0;
+  for (int i = 0; i < (int)profileEdges.size(); ++i) {
+    if (m > 0 && !(profileEdges[m - 1] < profileEdges[i]))
+      profileEdges[m - 1].count += profileEdges[i].count;
+    else
+      profileEdges[m++] = profileEdges[i];
+  }
+  profileEdges.resize(m);
+
+  outputReport(
+    start,
+    bbFunctionNames, bbNames,
+    bbCounters.data(), edges, profileEdges,
+    backEdgeTails, backEdgeHeads,
+    n, nloop,
+    cycleEntries, cycleEntryCycles, cycleInsideTails, cycleInsideHeads,
+    nentry, ninside, ncycle);
+}